@@ -17,6 +17,7 @@
 #define DIRECTORY_MISMATCH_INODE_FREE "inode referred to in directory but marked free"
 #define BAD_REFERENCE_COUNT_FILE "bad reference count for file"
 #define DIRECTORY_MULTIPLE_REFERNECE_ERROR "directory appears more than once in file system"
+#define BAD_SUPERBLOCK "superblock does not match the image"
 
 #define END ".\n"
 
@@ -2,18 +2,58 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "types.h"
 #include "fs.h"
 #include "errors.h"
 
 #define BLOCK_SIZE (BSIZE)
+#define MIN_TASKS_PER_WORKER 64 // directory blocks below which another thread costs more than it saves
+#define MAX_WORKERS 1024        // largest --threads accepted
+#define OWNED 1                 // block used by an inode
+#define OWNED_SAMPLED 2         // block used by a sampled inode, its bitmap mark is already checked
+
+// data blocks of an inode, each address validated once when it is read from the inode or indirect block.
+// the addresses themselves live in an array filled by load_block_list, block_addrs for inode_blocks.
+struct block_list
+{
+    uint first;    // index of the first address in block_addrs
+    uint ndirect;  // number of direct data blocks, stored first
+    uint nblocks;  // number of data blocks, direct then indirect
+    uint indirect; // indirect block, 0 if none
+};
+
+// one directory block to scan, the unit of work for the directory workers
+struct dir_task
+{
+    uint inum;  // directory inode
+    uint block; // validated data block of the directory
+};
+
+// a directory worker owns dir_tasks[top, bottom), popping from the bottom while thieves take from the top
+struct dir_worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock; // guards top and bottom
+    uint id;
+    uint top;
+    uint bottom;
+    uint *refs;       // entries naming each inode, counted by this worker
+    uint *named_refs; // same without "." and ".."
+    uint bad_dir;     // lowest directory with an entry past the inode table, ninodes if none
+};
 
 void error(char *e);
 void check_inode_addrs(void);
@@ -26,24 +66,122 @@ void check_directory_inode_used(void);
 void check_directory_inode_free(void);
 void check_bad_reference_file(void);
 void check_directory_references(void);
+void count_directory_entries(void);
+void *directory_worker(void *arg);
+bool next_directory_task(struct dir_worker *w, struct dir_task *task);
+char *map_image(int fd, off_t size);
+void advise_image(void);
+void advise_blocks(uint first, uint end, int advice);
+void prefetch_indirect_blocks(void);
+void prefetch_block(uint bnum);
+void flush_prefetch(void);
+void print_stats(void);
+bool parse_number(char *s, unsigned long long max, unsigned long long *value);
+void check_superblock(off_t image_size);
+struct dinode *get_inode(uint inum);
+void *get_block(uint bnum);
+bool bitmap_marked(uint bnum);
+bool valid_data_block(uint bnum);
+char *load_block_list(uint inum, struct block_list *bl, uint *addrs);
+void build_path_index(void);
+void index_directory_block(uint dir_inum, uint block);
+void print_inode_path(FILE *f, uint inum);
+void error_inode(char *e, uint inum);
+int sample_check(void);
+void sample_ownership(void);
+bool sample_inode(uint inum);
+bool sample_directory_block(uint dir_inum, uint block, bool first);
+bool sample_bitmap_word(uint word, bool *checkable);
+uint sample_random(uint n);
+uint sample_size(uint total);
+uint sample_stratum(uint stratum, uint strata, uint total);
+void sample_violation(char *e, char *unit, uint n);
+void sample_report(char *name, uint checked, uint corrupt);
+
+// inode-to-path index entry, filled by a single walk over all directories
+struct path_entry
+{
+    uint parent;      // inode number of the directory that names this inode
+    const char *name; // dirent name inside the mapped image (not copied)
+};
 
 char *addr;
 struct superblock *sb;
+struct block_list *inode_blocks; // validated blocks of every in-use inode, filled by check_inode_addrs
+uint *block_addrs;               // the addresses of all inode_blocks lists, back to back
+uint nthreads = 0;               // directory worker threads from --threads, 0 uses every online cpu
+struct dir_task *dir_tasks;      // every (directory, block) pair to scan
+struct dir_worker *dir_workers;
+uint ndir_workers;
+uint *dir_refs;                  // directory entries naming each inode
+uint *dir_named_refs;            // same without "." and ".."
+bool populate_image = false;     // --populate, fault in the whole image up front when it fits in memory
+bool image_populated = false;    // the whole image is resident, prefetching is pointless
+off_t mapped_size;               // length of the image mapping
+uint prefetch_first, prefetch_end; // run of consecutive blocks waiting for one MADV_WILLNEED
+bool print_paths = false;       // report the path of the offending inode with each error
+struct path_entry *path_index;  // one entry per inode, parent pointer and name
+uint *path_chain;               // scratch space to rebuild a path, one slot per inode
+double sample_rate = 0;         // fraction of the image checked by --sample, 0 runs the full checker
+unsigned long long sample_seed; // random state for --sample, seeded by --seed
+uint sample_violations = 0;     // definite violations found while sampling
+uint sampled_dir_blocks = 0;    // directory blocks examined while sampling
+uint corrupt_dir_blocks = 0;    // directory blocks with at least one violation
+uchar *owned_blocks;            // OWNED or OWNED_SAMPLED for every block some inode uses
 
 int main(int argc, char *argv[])
 {
     int n, fsfd;
     struct stat st;
+    char *image = NULL;
+    char *end;
+    bool bad_number = false;
+    unsigned long long value;
+
+    sample_seed = (unsigned long long)time(NULL) ^ getpid();
 
     // Check arguments
-    if (argc < 2)
+    for (n = 1; n < argc; n++)
     {
-        fprintf(stderr, "Usage: fcheck <file_system_image>\n");
+        if (strcmp(argv[n], "--paths") == 0)
+            print_paths = true;
+        else if (strncmp(argv[n], "--sample=", 9) == 0)
+        {
+            // anything but a number in (0, 1] fails the usage check below
+            sample_rate = strtod(argv[n] + 9, &end);
+            if (end == argv[n] + 9 || *end != '\0' || sample_rate <= 0)
+                sample_rate = -1;
+        }
+        else if (strcmp(argv[n], "--populate") == 0)
+            populate_image = true;
+        else if (strcmp(argv[n], "--stats") == 0)
+            atexit(print_stats);
+        else if (strncmp(argv[n], "--threads=", 10) == 0)
+        {
+            if (parse_number(argv[n] + 10, MAX_WORKERS, &value))
+                nthreads = value;
+            else
+                bad_number = true;
+        }
+        else if (strncmp(argv[n], "--seed=", 7) == 0)
+        {
+            if (parse_number(argv[n] + 7, ULLONG_MAX, &value))
+                sample_seed = value;
+            else
+                bad_number = true;
+        }
+        else
+            image = argv[n];
+    }
+    // the sampler never walks the whole tree, so it has no paths to report
+    if (image == NULL || bad_number || sample_rate < 0 || sample_rate > 1 || (print_paths && sample_rate > 0))
+    {
+        fprintf(stderr, "Usage: fcheck [--paths | --sample=P [--seed=N]] [--threads=N] [--populate] [--stats] <file_system_image>\n");
         exit(1);
     }
 
     // Open file system image
-    fsfd = open(argv[1], O_RDONLY);
+    fsfd = open(image, O_RDONLY);
     if (fsfd < 0)
     {
         perror("image not found\n");
@@ -59,22 +197,24 @@ int main(int argc, char *argv[])
     }
 
     // Map filesystem into memory
-    addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fsfd, 0);
-    if (addr == MAP_FAILED)
-    {
-        perror("mmap failed");
-        exit(1);
-    }
+    addr = map_image(fsfd, st.st_size);
 
     // Read superblock
     sb = (struct superblock *)(addr + 1 * BLOCK_SIZE);
+    check_superblock(st.st_size); // metadata must lie inside the image before anything else is read
+    advise_image();               // tell the kernel how each region of the image will be read
 
+    if (sample_rate > 0)
+        exit(sample_check()); // quick estimate on a random subset instead of the full check
+
+    prefetch_indirect_blocks();        // start reading indirect blocks while the inode table is checked
     check_inode_addrs();               // check inode addresses // check inodes // check directory format
     check_root_dir();                  // check root directory
     check_bitmap_mapping();            // check bitmap corresponding to inodes in-use
     check_inode_mapping();             // check inode map to address consistent with bitmap marked inuse
     check_multiple_direct_address();   // check multiple direct address
     check_multiple_indirect_address(); // check multiple direct address
+    count_directory_entries();         // count directory references of every inode, in parallel
     check_directory_inode_used();      // check directories for inode marked used
     check_directory_inode_free();      // check directories for inode marked free
     check_bad_reference_file();        // check if there is bad reference for file
@@ -85,342 +225,292 @@ int main(int argc, char *argv[])
 
 void check_directory_references()
 {
-    int i, j;
+    int i;
     struct dinode *dip;
-    // default directory_in_use array with zero
-    uint *directory_in_use = malloc(sizeof(uint) * sb->ninodes);
-    for (i = 0; i < sb->ninodes; i++)
-    {
-        directory_in_use[i] = 0;
-    }
-    for (i = 0; i < sb->ninodes; i++)
+    for (i = 1; i < sb->ninodes; i++)
     {
-        int inode_block = IBLOCK(i); // get inode block
-        int inode_offset = i % IPB;  // get inode offset
-        // get inode
-        dip = (struct dinode *)(addr + inode_block * BLOCK_SIZE + inode_offset * sizeof(struct dinode));
-        if (dip->type == T_DIR)
+        dip = get_inode(i); // get inode
+        // if inode type is directory and if number of references are greater than one, then throw the error.
+        // "." and ".." are not counted, they are the directory itself and its parent
+        if (dip->type == T_DIR && dir_named_refs[i] > 1)
         {
-            for (j = 0; j < NDIRECT; j++)
-            {
-                struct dirent *de = (struct dirent *)(addr + (dip->addrs[j]) * BLOCK_SIZE);
-                int k;
-                for (k = 0; k < DPB; k++)
-                {
-                    if (de[k].inum == 0)
-                        continue;
-                    // omit root directory and self link
-                    if ((strcmp(de[k].name, ".") != 0) && (strcmp(de[k].name, "..") != 0))
-                    {
-                        directory_in_use[de[k].inum]++;
-                    }
-                }
-            }
-            if (dip->addrs[NDIRECT] != 0)
-            {
-                uint *indirect_block = (uint *)(addr + dip->addrs[NDIRECT] * BLOCK_SIZE);
-                for (j = 0; j < NINDIRECT; j++)
-                {
-                    int k;
-                    for (k = 0; k < DPB; k++)
-                    {
-                        struct dirent *de = (struct dirent *)(addr + (indirect_block[j]) * BLOCK_SIZE);
-                        if (de[k].inum == 0)
-                            continue;
-                        // omit root directory and self link
-                        if ((strcmp(de[k].name, ".") != 0) && (strcmp(de[k].name, "..") != 0))
-                            directory_in_use[de[k].inum]++;
-                    }
-                }
-            }
+            error_inode(DIRECTORY_MULTIPLE_REFERNECE_ERROR, i);
         }
     }
+}
 
+void check_bad_reference_file(void)
+{
+    int i;
+    struct dinode *dip;
     for (i = 1; i < sb->ninodes; i++)
     {
-        int inode_block = IBLOCK(i); // get inode block
-        int inode_offset = i % IPB;  // get inode offset
-        // get inode
-        dip = (struct dinode *)(addr + inode_block * BLOCK_SIZE + inode_offset * sizeof(struct dinode));
-        // if inode type is directory and if number of references are greater than one, then throw the error.
-        if (dip->type == T_DIR && directory_in_use[i] > 1)
+        dip = get_inode(i); // get inode
+        // if inode type is file and number oflinks is not equal to number of directory references then throw the error
+        if (dip->type == T_FILE && dir_refs[i] != dip->nlink)
         {
-            error(DIRECTORY_MULTIPLE_REFERNECE_ERROR);
+            error_inode(BAD_REFERENCE_COUNT_FILE, i);
         }
-        dip++;
     }
 }
 
-void check_bad_reference_file(void)
+void check_directory_inode_free(void)
 {
-    int i, j;
+    int i;
     struct dinode *dip;
-    // default directory_in_use array with zero
-    uint *directory_in_use = malloc(sizeof(uint) * sb->ninodes);
-    for (i = 0; i < sb->ninodes; i++)
-    {
-        directory_in_use[i] = 0;
-    }
-    for (i = 0; i < sb->ninodes; i++)
+    // check if inode referred to in directory but marked free
+    // excluding unused inode at start
+    for (i = 1; i < sb->ninodes; i++)
     {
-        int inode_block = IBLOCK(i); // get inode block
-        int inode_offset = i % IPB;  // get inode offset
-        // get inode
-        dip = (struct dinode *)(addr + inode_block * BLOCK_SIZE + inode_offset * sizeof(struct dinode));
-        if (dip->type == T_DIR)
+        dip = get_inode(i); // get inode
+        if (dip->type == 0 && dir_refs[i] != 0)
         {
-            for (j = 0; j < NDIRECT; j++)
-            {
-                struct dirent *de = (struct dirent *)(addr + (dip->addrs[j]) * BLOCK_SIZE);
-                int k;
-                for (k = 0; k < DPB; k++)
-                {
-                    if (de[k].inum == 0)
-                        continue;
-                    directory_in_use[de[k].inum]++;
-                }
-            }
-            if (dip->addrs[NDIRECT] != 0)
-            {
-                uint *indirect_block = (uint *)(addr + dip->addrs[NDIRECT] * BLOCK_SIZE);
-                for (j = 0; j < NINDIRECT; j++)
-                {
-                    int k;
-                    for (k = 0; k < DPB; k++)
-                    {
-                        struct dirent *de = (struct dirent *)(addr + (indirect_block[j]) * BLOCK_SIZE);
-                        if (de[k].inum == 0)
-                            continue;
-                        directory_in_use[de[k].inum]++;
-                    }
-                }
-            }
+            error_inode(DIRECTORY_MISMATCH_INODE_FREE, i);
         }
     }
+}
 
+void check_directory_inode_used(void)
+{
+    int i;
+    struct dinode *dip;
+    // check if inode marked in use but not found in directory
+    // excluding unused inode at start
     for (i = 1; i < sb->ninodes; i++)
     {
-        int inode_block = IBLOCK(i); // get inode block
-        int inode_offset = i % IPB;  // get inode offset
-        // get inode
-        dip = (struct dinode *)(addr + inode_block * BLOCK_SIZE + inode_offset * sizeof(struct dinode));
-        // if inode type is file and number oflinks is not equal to number of directory references then throw the error
-        if (dip->type == T_FILE && directory_in_use[i] != dip->nlink)
+        dip = get_inode(i); // get inode
+        if (dip->type != 0 && dir_refs[i] == 0)
         {
-            error(BAD_REFERENCE_COUNT_FILE);
+            error_inode(DIRECTORY_MISMATCH_INODE_INUSE, i);
         }
-        dip++;
     }
 }
 
-void check_directory_inode_free(void)
+// scan every directory block once, spread over worker threads, and merge their counts
+// into dir_refs and dir_named_refs for the directory checks
+void count_directory_entries(void)
 {
-    int i, j;
+    uint i, j, ntasks = 0;
+    uint bad_dir;
     struct dinode *dip;
-    uint *directory_in_use = malloc(sizeof(uint) * sb->ninodes);
+
+    // one task per (directory, block) pair, so a single huge directory still splits up
     for (i = 0; i < sb->ninodes; i++)
     {
-        int inode_block = IBLOCK(i); // get inode block
-        int inode_offset = i % IPB;  // get inode offset
-        // get inode
-        dip = (struct dinode *)(addr + inode_block * BLOCK_SIZE + inode_offset * sizeof(struct dinode));
+        dip = get_inode(i);
         if (dip->type == T_DIR)
+            ntasks += inode_blocks[i].nblocks;
+    }
+    dir_tasks = malloc(sizeof(struct dir_task) * (ntasks + 1));
+    ntasks = 0;
+    for (i = 0; i < sb->ninodes; i++)
+    {
+        dip = get_inode(i);
+        if (dip->type != T_DIR)
+            continue;
+        for (j = 0; j < inode_blocks[i].nblocks; j++)
         {
-            for (j = 0; j < NDIRECT; j++)
-            {
-                struct dirent *de = (struct dirent *)(addr + (dip->addrs[j]) * BLOCK_SIZE);
-                int k;
-                for (k = 0; k < DPB; k++)
-                {
-                    if (de[k].inum == 0)
-                        continue;
-                    directory_in_use[de[k].inum] = 1;
-                }
-            }
-            if (dip->addrs[NDIRECT] != 0)
+            dir_tasks[ntasks].inum = i;
+            dir_tasks[ntasks].block = block_addrs[inode_blocks[i].first + j];
+            ntasks++;
+        }
+    }
+
+    // by default small images are not worth the threads, --threads is taken as given
+    ndir_workers = nthreads;
+    if (ndir_workers == 0)
+    {
+        ndir_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (ndir_workers > ntasks / MIN_TASKS_PER_WORKER)
+            ndir_workers = ntasks / MIN_TASKS_PER_WORKER;
+    }
+    if (ndir_workers > ntasks)
+        ndir_workers = ntasks;
+    if (ndir_workers < 1)
+        ndir_workers = 1;
+
+    // each worker starts with a contiguous slice of the tasks and steals once it runs dry
+    dir_workers = calloc(ndir_workers, sizeof(struct dir_worker));
+    for (i = 0; i < ndir_workers; i++)
+    {
+        struct dir_worker *w = &dir_workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->id = i;
+        w->top = (unsigned long long)ntasks * i / ndir_workers;
+        w->bottom = (unsigned long long)ntasks * (i + 1) / ndir_workers;
+        w->refs = calloc(sb->ninodes, sizeof(uint));
+        w->named_refs = calloc(sb->ninodes, sizeof(uint));
+        w->bad_dir = sb->ninodes;
+    }
+    if (ndir_workers == 1)
+    {
+        directory_worker(&dir_workers[0]);
+    }
+    else
+    {
+        for (i = 0; i < ndir_workers; i++)
+        {
+            if (pthread_create(&dir_workers[i].thread, NULL, directory_worker, &dir_workers[i]) != 0)
             {
-                uint *indirect_block = (uint *)(addr + dip->addrs[NDIRECT] * BLOCK_SIZE);
-                for (j = 0; j < NINDIRECT; j++)
-                {
-                    int k;
-                    for (k = 0; k < DPB; k++)
-                    {
-                        struct dirent *de = (struct dirent *)(addr + (indirect_block[j]) * BLOCK_SIZE);
-                        if (de[k].inum == 0)
-                            continue;
-                        directory_in_use[de[k].inum] = 1;
-                    }
-                }
+                perror("pthread_create failed");
+                exit(1);
             }
         }
+        for (i = 0; i < ndir_workers; i++)
+        {
+            pthread_join(dir_workers[i].thread, NULL);
+        }
     }
 
-    // check if inode marked in use but not found in directory
-    // excluding unused inode at start
-    for (i = 1; i < sb->ninodes; i++)
+    // the lowest bad directory keeps the report independent of how the tasks were split
+    bad_dir = sb->ninodes;
+    for (i = 0; i < ndir_workers; i++)
     {
-        int inode_block = IBLOCK(i); // get inode block
-        int inode_offset = i % IPB;  // get inode offset
-        // get inode
-        dip = (struct dinode *)(addr + inode_block * BLOCK_SIZE + inode_offset * sizeof(struct dinode));
-        if (dip->type == 0 && directory_in_use[i] != 0)
+        if (dir_workers[i].bad_dir < bad_dir)
+            bad_dir = dir_workers[i].bad_dir;
+    }
+    if (bad_dir < sb->ninodes)
+    {
+        error_inode(DIRECTORY_MISMATCH_INODE_FREE, bad_dir);
+    }
+
+    // merge the per worker counters into the first worker's
+    dir_refs = dir_workers[0].refs;
+    dir_named_refs = dir_workers[0].named_refs;
+    for (i = 1; i < ndir_workers; i++)
+    {
+        for (j = 0; j < sb->ninodes; j++)
         {
-            error(DIRECTORY_MISMATCH_INODE_FREE);
+            dir_refs[j] += dir_workers[i].refs[j];
+            dir_named_refs[j] += dir_workers[i].named_refs[j];
         }
-        dip++;
     }
 }
 
-void check_directory_inode_used(void)
+void *directory_worker(void *arg)
 {
-    int i, j;
-    struct dinode *dip;
-    uint *directory_in_use = malloc(sizeof(uint) * sb->ninodes);
-    for (i = 0; i < sb->ninodes; i++)
+    struct dir_worker *w = arg;
+    struct dir_task task;
+    int k;
+    while (next_directory_task(w, &task))
     {
-        int inode_block = IBLOCK(i); // get inode block
-        int inode_offset = i % IPB;  // get inode offset
-        // get inode
-        dip = (struct dinode *)(addr + inode_block * BLOCK_SIZE + inode_offset * sizeof(struct dinode));
-        if (dip->type == T_DIR)
+        struct dirent *de = (struct dirent *)get_block(task.block);
+        for (k = 0; k < DPB; k++)
         {
-            for (j = 0; j < NDIRECT; j++)
-            {
-                struct dirent *de = (struct dirent *)(addr + (dip->addrs[j]) * BLOCK_SIZE);
-                int k;
-                for (k = 0; k < DPB; k++)
-                {
-                    if (de[k].inum == 0)
-                        continue;
-                    directory_in_use[de[k].inum] = 1;
-                }
-            }
-            if (dip->addrs[NDIRECT] != 0)
+            if (de[k].inum == 0)
+                continue;
+            // an entry past the inode table names an inode that can never be in use
+            if (de[k].inum >= sb->ninodes)
             {
-                uint *indirect_block = (uint *)(addr + dip->addrs[NDIRECT] * BLOCK_SIZE);
-                for (j = 0; j < NINDIRECT; j++)
-                {
-                    int k;
-                    for (k = 0; k < DPB; k++)
-                    {
-                        struct dirent *de = (struct dirent *)(addr + (indirect_block[j]) * BLOCK_SIZE);
-                        if (de[k].inum == 0)
-                            continue;
-                        directory_in_use[de[k].inum] = 1;
-                    }
-                }
+                if (task.inum < w->bad_dir)
+                    w->bad_dir = task.inum;
+                continue;
             }
+            w->refs[de[k].inum]++;
+            // omit root directory and self link
+            if ((strcmp(de[k].name, ".") != 0) && (strcmp(de[k].name, "..") != 0))
+                w->named_refs[de[k].inum]++;
         }
     }
+    return NULL;
+}
 
-    // check if inode marked in use but not found in directory
-    // excluding unused inode at start
-    for (i = 1; i < sb->ninodes; i++)
+// take the newest task of the worker's own slice, or steal the oldest task of another worker.
+// no tasks are added once the workers start, so one empty pass over all slices means done.
+bool next_directory_task(struct dir_worker *w, struct dir_task *task)
+{
+    uint i;
+    bool found = false;
+    pthread_mutex_lock(&w->lock);
+    if (w->top < w->bottom)
+    {
+        *task = dir_tasks[--w->bottom];
+        found = true;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    for (i = 1; !found && i < ndir_workers; i++)
     {
-        int inode_block = IBLOCK(i); // get inode block
-        int inode_offset = i % IPB;  // get inode offset
-        // get inode
-        dip = (struct dinode *)(addr + inode_block * BLOCK_SIZE + inode_offset * sizeof(struct dinode));
-        if (dip->type != 0 && directory_in_use[i] == 0)
+        struct dir_worker *victim = &dir_workers[(w->id + i) % ndir_workers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->top < victim->bottom)
         {
-            error(DIRECTORY_MISMATCH_INODE_INUSE);
+            *task = dir_tasks[victim->top++];
+            found = true;
         }
-        dip++;
+        pthread_mutex_unlock(&victim->lock);
     }
+    return found;
 }
 
 void check_multiple_indirect_address(void)
 {
     int i, j;
-    struct dinode *dip;
-    uint *indirect_data_blocks_inuse = malloc(sizeof(uint) * sb->nblocks);
+    uint *indirect_data_blocks_inuse = calloc(sb->size, sizeof(uint));
     for (i = 0; i < sb->ninodes; i++)
     {
-        dip = (struct dinode *)(addr + 2 * BLOCK_SIZE + i * sizeof(struct dinode));
-        if (dip->type != 0)
+        // data blocks listed in the indirect block follow the direct ones
+        struct block_list *bl = &inode_blocks[i];
+        uint *addrs = &block_addrs[bl->first];
+        for (j = bl->ndirect; j < bl->nblocks; j++)
         {
-            if (dip->addrs[NDIRECT] == 0)
-                continue;
-            uint *indirect_block = (uint *)(addr + dip->addrs[NDIRECT] * BLOCK_SIZE);
-            for (j = 0; j < NINDIRECT; j++)
+            if (indirect_data_blocks_inuse[addrs[j]] == 1)
             {
-                if (indirect_block[j] == 0)
-                    continue;
-                if (indirect_data_blocks_inuse[indirect_block[j]] == 1)
-                {
-                    error(MULTIPLE_INDIRECT_BLOCKS_INUSE);
-                }
-
-                indirect_data_blocks_inuse[indirect_block[j]] = 1;
+                error_inode(MULTIPLE_INDIRECT_BLOCKS_INUSE, i);
             }
+
+            indirect_data_blocks_inuse[addrs[j]] = 1;
         }
     }
 }
 
 void check_multiple_direct_address(void)
 {
-    uint *direct_data_blocks_inuse = malloc(sizeof(uint) * sb->nblocks);
+    uint *direct_data_blocks_inuse = calloc(sb->size, sizeof(uint));
     int i, j;
-    struct dinode *dip;
     for (i = 0; i < sb->ninodes; i++)
     {
-        dip = (struct dinode *)(addr + 2 * BLOCK_SIZE + i * sizeof(struct dinode));
-        if (dip->type != 0)
+        struct block_list *bl = &inode_blocks[i];
+        uint *addrs = &block_addrs[bl->first];
+        // direct blocks and the indirect block itself are all addresses stored in the inode
+        for (j = 0; j <= bl->ndirect; j++)
         {
-            for (j = 0; j < NDIRECT + 1; j++)
+            uint block = (j < bl->ndirect) ? addrs[j] : bl->indirect;
+            if (block == 0)
+                continue;
+            if (direct_data_blocks_inuse[block] == 1)
             {
-                if (dip->addrs[j] == 0)
-                    continue;
-                if (direct_data_blocks_inuse[dip->addrs[j]] == 1)
-                {
-                    error(MULTIPLE_DIRECT_BLOCKS_INUSE);
-                }
-
-                direct_data_blocks_inuse[dip->addrs[j]] = 1;
+                error_inode(MULTIPLE_DIRECT_BLOCKS_INUSE, i);
             }
+
+            direct_data_blocks_inuse[block] = 1;
         }
     }
 }
 
 void check_inode_mapping(void)
 {
-    // data blocks in use array
-    uint *data_blocks_inuse = malloc(sizeof(uint) * sb->nblocks);
+    // data blocks in use array, indexed by block number
+    uint *data_blocks_inuse = calloc(sb->size, sizeof(uint));
     int i, j;
-    struct dinode *dip;
     for (i = 0; i < sb->ninodes; i++)
     {
-        dip = (struct dinode *)(addr + 2 * BLOCK_SIZE + i * sizeof(struct dinode));
-        for (j = 0; j < NDIRECT + 1; j++)
+        struct block_list *bl = &inode_blocks[i];
+        uint *addrs = &block_addrs[bl->first];
+        for (j = 0; j < bl->nblocks; j++)
         {
-            if (dip->addrs[j] == 0)
-                continue;
-            data_blocks_inuse[dip->addrs[j]] = 1;
-            if (j == NDIRECT)
-            {
-                if (dip->addrs[j] == 0)
-                    continue;
-                data_blocks_inuse[dip->addrs[j]] = 1;
-                uint *indirect_block = (uint *)(addr + dip->addrs[j] * BLOCK_SIZE);
-                int k;
-                for (k = 0; k < NINDIRECT; k++)
-                {
-                    if (indirect_block[k] == 0)
-                        continue;
-                    data_blocks_inuse[indirect_block[k]] = 1;
-                }
-            }
+            data_blocks_inuse[addrs[j]] = 1;
         }
+        if (bl->indirect != 0)
+            data_blocks_inuse[bl->indirect] = 1;
     }
-    // get start address of bitmap block
-    char *bitmap = (char *)(addr + (3 * BSIZE) + ((sb->ninodes / IPB) * BSIZE));
     // get the first data block
     // adding four because adding  one superblock, two unused blocks, one bitmap block
     uint first_block = (sb->ninodes / IPB + 4);
     // loop through the data blocks from first data block to last data block and verify inconsistency
     for (i = first_block; i < sb->nblocks; i++)
     {
-        if (((bitmap[i / 8] & (1 << (i % 8))) != 0) && (data_blocks_inuse[i] == 0))
+        if (bitmap_marked(i) && (data_blocks_inuse[i] == 0))
         {
             error(MISSING_INODE_MARK);
         }
@@ -430,69 +520,23 @@ void check_inode_mapping(void)
 void check_bitmap_mapping(void)
 {
     int i, j;
-    struct dinode *dip;
     for (i = 0; i < sb->ninodes; i++)
     {
-        int inode_block = IBLOCK(i); // get inode block
-        int inode_offset = i % IPB;  // get inode offset
-        // get inode
-        dip = (struct dinode *)(addr + inode_block * BLOCK_SIZE + inode_offset * sizeof(struct dinode));
-        for (j = 0; j < NDIRECT + 1; j++)
+        struct block_list *bl = &inode_blocks[i];
+        uint *addrs = &block_addrs[bl->first];
+        // verify if address is used by inode but marked free in bitmap, direct and indirect data blocks
+        for (j = 0; j < bl->nblocks; j++)
         {
-            // verify if address is used by inode but marked free in bitmap in direct nodes
-
-            // if data block address is empty, skip
-            // type =0; unused
-            if (dip->addrs[j] == 0)
-            {
-                continue;
-            }
-            // get start address of bitmap block
-            char *bitmap = (char *)(addr + (3 * BSIZE) + ((sb->ninodes / IPB) * BSIZE));
-            // get block number
-            uint direct_block_number = dip->addrs[j];
-            // get block offset
-            uint direct_block_offset = direct_block_number / 8;
-            // get bit offset
-            uint direct_bit_offset = direct_block_number % 8;
-            // get bit
-            uint bit = bitmap[direct_block_offset] & (1 << direct_bit_offset);
-            // check if bit is 0 and address is used by inode
-            if (bit == 0 && dip->addrs[j] != 0)
-            {
-                error(MISSING_BITMAP_MARK);
-            }
-
-            // verify if address is used by indirect inode but marked free in bitmap
-
-            if (j == NDIRECT)
+            if (!bitmap_marked(addrs[j]))
             {
-                // get indirect block
-                uint *indirect_block = (uint *)(addr + dip->addrs[j] * BLOCK_SIZE);
-                int k;
-                for (k = 0; k < NINDIRECT; k++)
-                {
-                    // if indirect data block address is empty, skip
-                    if (indirect_block[k] == 0)
-                    {
-                        continue;
-                    }
-                    // get block number
-                    uint indirect_block_number = indirect_block[k];
-                    // get block offset
-                    uint indirect_block_offset = indirect_block_number / 8;
-                    // get bit offset
-                    uint indirect_bit_offset = indirect_block_number % 8;
-                    // get bit
-                    uint bit = bitmap[indirect_block_offset] & (1 << indirect_bit_offset);
-                    // check if bit is 0 and address is used by inode
-                    if (bit == 0 && indirect_block[k] != 0)
-                    {
-                        error(MISSING_BITMAP_MARK);
-                    }
-                }
+                error_inode(MISSING_BITMAP_MARK, i);
             }
         }
+        // verify the indirect block itself
+        if (bl->indirect != 0 && !bitmap_marked(bl->indirect))
+        {
+            error_inode(MISSING_BITMAP_MARK, i);
+        }
     }
 }
 
@@ -500,52 +544,48 @@ void check_inode_addrs(void)
 {
     int i, j;
     struct dinode *dip;
-    int data_block_start = sb->size - sb->nblocks;
-    int data_block_end = sb->size - 1;
+    char *e;
+    uint used = 0, capacity = 0;
+    inode_blocks = calloc(sb->ninodes, sizeof(struct block_list));
     for (i = 0; i < sb->ninodes; i++)
     {
-        int inode_block = IBLOCK(i); // get inode block
-        int inode_offset = i % IPB;  // get inode offset
-        // get inode
-        dip = (struct dinode *)(addr + inode_block * BLOCK_SIZE + inode_offset * sizeof(struct dinode));
+        dip = get_inode(i); // get inode
         // dip->type == 0 -> unused inode
         if (dip->type == 0)
             continue;
         
         if (dip->type != T_DEV && dip->type != T_DIR && dip->type != T_FILE)
         {
-           error(BAD_INODE);
+           error_inode(BAD_INODE, i);
         }
 
-        // check direct addresses
-        for (j = 0; j < NDIRECT; j++)
+        // check direct and indirect addresses, keeping the valid ones for the other checks.
+        // free inodes take no room, so the array grows with the blocks actually in use.
+        if (used + MAXFILE > capacity)
         {
-            if ((dip->addrs[j] != 0) && (dip->addrs[j] < data_block_start || dip->addrs[j] > data_block_end))
-            {
-                error(BAD_DIRECT_ADDRESS_INODE);
-            }
+            capacity = capacity * 2 + MAXFILE;
+            block_addrs = realloc(block_addrs, sizeof(uint) * capacity);
         }
-        // check indirect addresses
-        if ((dip->addrs[NDIRECT] != 0) && (dip->addrs[NDIRECT] < data_block_start || dip->addrs[NDIRECT] > data_block_end))
+        inode_blocks[i].first = used;
+        e = load_block_list(i, &inode_blocks[i], &block_addrs[used]);
+        if (e != NULL)
         {
-            error(BAD_INDIRECT_ADDRESS_INODE);
+            error_inode(e, i);
         }
+        used += inode_blocks[i].nblocks;
 
-        uint *indirect = (uint *)(addr + dip->addrs[NDIRECT] * BLOCK_SIZE);
-        int k;
-        for (k = 0; k < NINDIRECT; k++)
+        // check_directory_format
+        if (dip->type == T_DIR)
         {
-            if ((indirect[k] != 0) && (indirect[k] < data_block_start || indirect[k] > data_block_end))
+            // directory blocks are scattered over the data region, ask for them as soon as they are
+            // known so they arrive while the rest of the inode table is checked
+            for (j = 0; j < inode_blocks[i].nblocks; j++)
             {
-                error(BAD_INDIRECT_ADDRESS_INODE);
+                prefetch_block(block_addrs[inode_blocks[i].first + j]);
             }
-        }
 
-        // check_directory_format
-        if (dip->type == T_DIR)
-        {
             // get the address of directory entry
-            struct dirent *de = (struct dirent *)(addr + (dip->addrs[0]) * BLOCK_SIZE);
+            struct dirent *de = (struct dirent *)get_block(dip->addrs[0]);
             bool is_self_linked = false;
             bool is_parent_linked = false;
             if ((strcmp(de->name, ".") == 0) && (de->inum == i))
@@ -560,30 +600,558 @@ void check_inode_addrs(void)
             if (!(is_self_linked && is_parent_linked))
             {
                 // if two entries ".",".." are not found (or) directory is not linked to itself then throw format error
-                error(DIRECTORY_NOT_FORMATTED_PROPERLY);
+                error_inode(DIRECTORY_NOT_FORMATTED_PROPERLY, i);
             }
         }
     }
+    flush_prefetch();
 }
 
+void check_superblock(off_t image_size)
+{
+    uint image_blocks = image_size / BLOCK_SIZE;
+    uint last_block;
+    if (image_blocks < 2)
+    {
+        error(BAD_SUPERBLOCK);
+    }
+    // the inode table, which holds at least the root inode, and the bitmap lie inside
+    // the file system, which lies inside the image
+    last_block = sb->size - 1;
+    if (sb->size == 0 || sb->size > image_blocks || sb->nblocks > sb->size || sb->ninodes <= ROOTINO ||
+        IBLOCK(sb->ninodes - 1) >= sb->size || BBLOCK(last_block, sb->ninodes) >= sb->size)
+    {
+        error(BAD_SUPERBLOCK);
+    }
+}
 
 void check_root_dir(void)
 {
-    int root_inode_block = IBLOCK(ROOTINO);
-    int root_inode_offset = ROOTINO % IPB;
-    struct dinode *root_inode = (struct dinode *)(addr + root_inode_block * BLOCK_SIZE + root_inode_offset * sizeof(struct dinode));
+    struct dinode *root_inode = get_inode(ROOTINO);
 
     if (root_inode->type != T_DIR)
     {
-        error(ROOT_DIR_DOES_NOT_EXIST);
+        error_inode(ROOT_DIR_DOES_NOT_EXIST, ROOTINO);
+    }
+
+    if (!valid_data_block(root_inode->addrs[0]))
+    {
+        error_inode(ROOT_DIR_DOES_NOT_EXIST, ROOTINO);
     }
 
-    struct dirent *de = (struct dirent *)(addr + root_inode->addrs[0] * BLOCK_SIZE);
+    struct dirent *de = (struct dirent *)get_block(root_inode->addrs[0]);
     de++;
     if (de->inum != ROOTINO)
     {
-        error(ROOT_DIR_DOES_NOT_EXIST);
+        error_inode(ROOT_DIR_DOES_NOT_EXIST, ROOTINO);
+    }
+}
+
+struct dinode *get_inode(uint inum)
+{
+    return (struct dinode *)(addr + (size_t)IBLOCK(inum) * BLOCK_SIZE + (inum % IPB) * sizeof(struct dinode));
+}
+
+void *get_block(uint bnum)
+{
+    return addr + (size_t)bnum * BLOCK_SIZE;
+}
+
+bool bitmap_marked(uint bnum)
+{
+    uchar *bitmap = (uchar *)get_block(BBLOCK(bnum, sb->ninodes));
+    return (bitmap[(bnum % BPB) / 8] & (1 << (bnum % 8))) != 0;
+}
+
+bool valid_data_block(uint bnum)
+{
+    return bnum >= sb->size - sb->nblocks && bnum < sb->size;
+}
+
+// read the addresses of inode inum into addrs, which has room for MAXFILE, and count them in bl.
+// returns the first bad address error or NULL. only valid blocks are stored, so loops over them
+// can read the blocks without further checks.
+char *load_block_list(uint inum, struct block_list *bl, uint *addrs)
+{
+    int j;
+    struct dinode *dip = get_inode(inum);
+    bl->ndirect = bl->nblocks = bl->indirect = 0;
+    for (j = 0; j < NDIRECT; j++)
+    {
+        if (dip->addrs[j] == 0)
+            continue;
+        if (!valid_data_block(dip->addrs[j]))
+            return BAD_DIRECT_ADDRESS_INODE;
+        addrs[bl->nblocks++] = dip->addrs[j];
+    }
+    bl->ndirect = bl->nblocks;
+    if (dip->addrs[NDIRECT] == 0)
+        return NULL;
+    if (!valid_data_block(dip->addrs[NDIRECT]))
+        return BAD_INDIRECT_ADDRESS_INODE;
+    bl->indirect = dip->addrs[NDIRECT];
+    uint *indirect_block = (uint *)get_block(bl->indirect);
+    for (j = 0; j < NINDIRECT; j++)
+    {
+        if (indirect_block[j] == 0)
+            continue;
+        if (!valid_data_block(indirect_block[j]))
+            return BAD_INDIRECT_ADDRESS_INODE;
+        addrs[bl->nblocks++] = indirect_block[j];
+    }
+    return NULL;
+}
+
+void build_path_index(void)
+{
+    int i, j;
+    struct block_list bl;
+    uint addrs[MAXFILE];
+    path_index = calloc(sb->ninodes, sizeof(struct path_entry));
+    path_chain = malloc(sizeof(uint) * sb->ninodes);
+    for (i = 0; i < sb->ninodes; i++)
+    {
+        if (get_inode(i)->type != T_DIR)
+            continue;
+        // blocks after a bad address are skipped, the error itself is reported by the checks
+        load_block_list(i, &bl, addrs);
+        for (j = 0; j < bl.nblocks; j++)
+        {
+            index_directory_block(i, addrs[j]);
+        }
+    }
+}
+
+void index_directory_block(uint dir_inum, uint block)
+{
+    int k;
+    struct dirent *de = (struct dirent *)get_block(block);
+    for (k = 0; k < DPB; k++)
+    {
+        if (de[k].inum == 0 || de[k].inum >= sb->ninodes)
+            continue;
+        if ((strncmp(de[k].name, ".", DIRSIZ) == 0) || (strncmp(de[k].name, "..", DIRSIZ) == 0))
+            continue;
+        // keep the first name seen for inodes with several hard links
+        if (path_index[de[k].inum].name == NULL)
+        {
+            path_index[de[k].inum].parent = dir_inum;
+            path_index[de[k].inum].name = de[k].name;
+        }
+    }
+}
+
+void print_inode_path(FILE *f, uint inum)
+{
+    uint depth = 0;
+    uint cur = inum;
+    // follow parent pointers up to the root, bounded by ninodes in case of loops
+    while (cur != ROOTINO)
+    {
+        if (cur >= sb->ninodes || path_index[cur].name == NULL || depth == sb->ninodes)
+        {
+            fprintf(f, "inode %u", inum);
+            return;
+        }
+        path_chain[depth++] = cur;
+        cur = path_index[cur].parent;
+    }
+    if (depth == 0)
+        fprintf(f, "/");
+    while (depth > 0)
+    {
+        const char *name = path_index[path_chain[--depth]].name;
+        fprintf(f, "/%.*s", (int)strnlen(name, DIRSIZ), name);
+    }
+}
+
+void error_inode(char *e, uint inum)
+{
+    if (!print_paths)
+        error(e);
+    // built on the first error only, a clean image never pays for the extra directory walk
+    if (path_index == NULL)
+        build_path_index();
+    fprintf(stderr, "%s%s (", ERROR, e);
+    print_inode_path(stderr, inum);
+    fprintf(stderr, ")%s", END);
+    exit(1);
+}
+
+int sample_check(void)
+{
+    uint i, k;
+    uint ninode_blocks = (sb->ninodes + IPB - 1) / IPB;
+    uint bitmap_words = ((sb->size - 1) / BPB + 1) * (BSIZE / sizeof(uint));
+    uint sampled_inodes = 0, corrupt_inodes = 0;
+    uint sampled_words = 0, corrupt_words = 0;
+    unsigned long long seed = sample_seed;
+    bool checkable;
+
+    // every owned block is known before any bitmap word is judged, directory blocks are sampled on the way
+    sample_ownership();
+
+    // stratified: one random inode block out of each equal slice of the inode table
+    uint strata = sample_size(ninode_blocks);
+    for (i = 0; i < strata; i++)
+    {
+        uint first = sample_stratum(i, strata, ninode_blocks) * IPB;
+        for (k = first; k < first + IPB && k < sb->ninodes; k++)
+        {
+            // inode 0 is never used
+            if (k == 0 || get_inode(k)->type == 0)
+                continue;
+            sampled_inodes++;
+            if (sample_inode(k))
+                corrupt_inodes++;
+        }
+    }
+
+    // words holding only metadata bits say nothing about the data blocks and are not counted
+    strata = sample_size(bitmap_words);
+    for (i = 0; i < strata; i++)
+    {
+        bool corrupt = sample_bitmap_word(sample_stratum(i, strata, bitmap_words), &checkable);
+        if (!checkable)
+            continue;
+        sampled_words++;
+        if (corrupt)
+            corrupt_words++;
+    }
+
+    printf("sample: rate %g, seed %llu\n", sample_rate, seed);
+    sample_report("inodes", sampled_inodes, corrupt_inodes);
+    sample_report("bitmap words", sampled_words, corrupt_words);
+    sample_report("directory blocks", sampled_dir_blocks, corrupt_dir_blocks);
+    return sample_violations > 0 ? 1 : 0;
+}
+
+// one sequential sweep of the inode table, plus the indirect blocks, gives the owner map the
+// bitmap words are judged against. every directory block met on the way is picked with
+// probability P, so the directory blocks form a uniform sample of their own.
+void sample_ownership(void)
+{
+    uint i, j;
+    struct dinode *dip;
+    struct block_list bl;
+    uint addrs[MAXFILE];
+    owned_blocks = calloc(sb->size, sizeof(uchar));
+    for (i = 1; i < sb->ninodes; i++)
+    {
+        dip = get_inode(i);
+        // addresses of inodes with a bad type mean nothing
+        if (dip->type != T_DEV && dip->type != T_DIR && dip->type != T_FILE)
+            continue;
+        load_block_list(i, &bl, addrs);
+        for (j = 0; j < bl.nblocks; j++)
+        {
+            owned_blocks[addrs[j]] = OWNED;
+        }
+        if (bl.indirect != 0)
+            owned_blocks[bl.indirect] = OWNED;
+        if (dip->type != T_DIR)
+            continue;
+        for (j = 0; j < bl.nblocks; j++)
+        {
+            if (sample_random(1000000) >= sample_rate * 1000000)
+                continue;
+            // the first directory block holds "." and ".."
+            sample_directory_block(i, addrs[j], j == 0 && dip->addrs[0] != 0);
+        }
+    }
+}
+
+bool sample_inode(uint inum)
+{
+    int j;
+    bool corrupt = false;
+    struct dinode *dip = get_inode(inum);
+    struct block_list bl;
+    uint addrs[MAXFILE];
+    char *e;
+
+    if (dip->type != T_DEV && dip->type != T_DIR && dip->type != T_FILE)
+    {
+        sample_violation(BAD_INODE, "inode", inum);
+        return true;
+    }
+    if (inum == ROOTINO && dip->type != T_DIR)
+    {
+        sample_violation(ROOT_DIR_DOES_NOT_EXIST, "inode", inum);
+        corrupt = true;
+    }
+
+    // the valid blocks up to the first bad address are still checked
+    e = load_block_list(inum, &bl, addrs);
+    if (e != NULL)
+    {
+        sample_violation(e, "inode", inum);
+        corrupt = true;
+    }
+    for (j = 0; j < bl.nblocks; j++)
+    {
+        owned_blocks[addrs[j]] = OWNED_SAMPLED;
+        if (!bitmap_marked(addrs[j]))
+        {
+            sample_violation(MISSING_BITMAP_MARK, "inode", inum);
+            corrupt = true;
+        }
+    }
+    if (bl.indirect != 0)
+    {
+        owned_blocks[bl.indirect] = OWNED_SAMPLED;
+        if (!bitmap_marked(bl.indirect))
+        {
+            sample_violation(MISSING_BITMAP_MARK, "inode", inum);
+            corrupt = true;
+        }
+    }
+
+    // the block list skips holes, so a directory without addrs[0] has no "." at all
+    if (dip->type == T_DIR && dip->addrs[0] == 0)
+    {
+        sample_violation(DIRECTORY_NOT_FORMATTED_PROPERLY, "inode", inum);
+        corrupt = true;
     }
+    return corrupt;
+}
+
+bool sample_directory_block(uint dir_inum, uint block, bool first)
+{
+    int k;
+    bool corrupt = false;
+    struct dirent *de = (struct dirent *)get_block(block);
+
+    sampled_dir_blocks++;
+    if (first)
+    {
+        if (!(strncmp(de[0].name, ".", DIRSIZ) == 0 && de[0].inum == dir_inum && strncmp(de[1].name, "..", DIRSIZ) == 0))
+        {
+            sample_violation(DIRECTORY_NOT_FORMATTED_PROPERLY, "inode", dir_inum);
+            corrupt = true;
+        }
+        if (dir_inum == ROOTINO && de[1].inum != ROOTINO)
+        {
+            sample_violation(ROOT_DIR_DOES_NOT_EXIST, "inode", dir_inum);
+            corrupt = true;
+        }
+    }
+    for (k = 0; k < DPB; k++)
+    {
+        if (de[k].inum == 0)
+            continue;
+        // an entry past the inode table names an inode that can never be in use
+        if (de[k].inum >= sb->ninodes || get_inode(de[k].inum)->type == 0)
+        {
+            sample_violation(DIRECTORY_MISMATCH_INODE_FREE, "inode", de[k].inum);
+            corrupt = true;
+        }
+    }
+    if (corrupt)
+        corrupt_dir_blocks++;
+    return corrupt;
+}
+
+// bits of data blocks must match the owner map and bits past the end of the image must be clear.
+// metadata bits are not checked, a word with nothing else is not checkable.
+bool sample_bitmap_word(uint word, bool *checkable)
+{
+    uint b;
+    bool corrupt = false;
+    uint data_block_start = sb->size - sb->nblocks;
+    *checkable = false;
+    for (b = word * 32; b < (word + 1) * 32; b++)
+    {
+        if (b < data_block_start)
+            continue;
+        *checkable = true;
+        if (bitmap_marked(b) && (b >= sb->size || !owned_blocks[b]))
+        {
+            sample_violation(MISSING_INODE_MARK, "block", b);
+            corrupt = true;
+        }
+        else if (!bitmap_marked(b) && b < sb->size && owned_blocks[b])
+        {
+            // a sampled owner has already reported it
+            if (owned_blocks[b] == OWNED)
+                sample_violation(MISSING_BITMAP_MARK, "block", b);
+            corrupt = true;
+        }
+    }
+    return corrupt;
+}
+
+// splitmix64, small and reproducible for a given --seed on every platform
+uint sample_random(uint n)
+{
+    unsigned long long z = (sample_seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return (uint)(z % n);
+}
+
+uint sample_size(uint total)
+{
+    uint n = (uint)ceil(sample_rate * total);
+    if (n < 1)
+        n = 1;
+    return n > total ? total : n;
+}
+
+// pick one index uniformly from slice number stratum of [0, total)
+uint sample_stratum(uint stratum, uint strata, uint total)
+{
+    uint lo = (unsigned long long)stratum * total / strata;
+    uint hi = (unsigned long long)(stratum + 1) * total / strata;
+    return lo + sample_random(hi - lo);
+}
+
+void sample_violation(char *e, char *unit, uint n)
+{
+    fprintf(stderr, "%s%s (%s %u)%s", ERROR, e, unit, n, END);
+    sample_violations++;
+}
+
+// corruption rate with the upper end of the 95% Wilson score interval
+void sample_report(char *name, uint checked, uint corrupt)
+{
+    double z = 1.96;
+    if (checked == 0)
+    {
+        printf("%s: not estimated, nothing checkable was sampled\n", name);
+        return;
+    }
+    double p = (double)corrupt / checked;
+    double n = checked;
+    double upper = (p + z * z / (2 * n) + z * sqrt(p * (1 - p) / n + z * z / (4 * n * n))) / (1 + z * z / n);
+    printf("%s: %u of %u corrupt, estimated rate %.2f%% (95%% upper bound %.2f%%)\n",
+           name, corrupt, checked, 100 * p, 100 * upper);
+}
+
+char *map_image(int fd, off_t size)
+{
+    char *image;
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t off;
+
+    image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(1);
+    }
+    mapped_size = size;
+
+    // only populate images that take at most half of physical memory
+    if (!populate_image || pages <= 0 || size > (off_t)pages * page_size / 2)
+        return image;
+#ifdef MADV_HUGEPAGE
+    // asked for before any page is touched, so the faults below can use huge pages where the
+    // kernel supports them for file mappings, ignored elsewhere
+    madvise(image, size, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_POPULATE_READ
+    if (madvise(image, size, MADV_POPULATE_READ) == 0)
+    {
+        image_populated = true;
+        return image;
+    }
+#endif
+    // older kernels: fault every page in by reading it
+    for (off = 0; off < size; off += page_size)
+    {
+        (void)*(volatile char *)(image + off);
+    }
+    image_populated = true;
+    return image;
+}
+
+// the inode table and bitmap are swept in order, data blocks are reached through addresses.
+// the sampler jumps around everywhere, so readahead only wastes IO there.
+void advise_image(void)
+{
+    uint data_block_start = sb->size - sb->nblocks;
+    if (sample_rate > 0)
+    {
+        advise_blocks(0, sb->size, MADV_RANDOM);
+        return;
+    }
+    advise_blocks(0, data_block_start, MADV_SEQUENTIAL);
+    advise_blocks(0, data_block_start, MADV_WILLNEED);
+    advise_blocks(data_block_start, sb->size, MADV_RANDOM);
+}
+
+void advise_blocks(uint first, uint end, int advice)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t start = (off_t)first * BLOCK_SIZE / page_size * page_size; // page holding the first block
+    off_t stop = (off_t)end * BLOCK_SIZE;
+    // a page shared with the previous region keeps that region's access pattern,
+    // a prefetch covers every page the blocks touch
+    if (advice != MADV_WILLNEED && start < (off_t)first * BLOCK_SIZE)
+        start += page_size;
+    if (stop > mapped_size)
+        stop = mapped_size;
+    if (start >= stop)
+        return;
+    // a populated image is resident already
+    if (advice == MADV_WILLNEED && image_populated)
+        return;
+    // advice is only a hint, a kernel that refuses it reads the image all the same
+    madvise(addr + start, stop - start, advice);
+}
+
+void prefetch_indirect_blocks(void)
+{
+    int i;
+    struct dinode *dip;
+    for (i = 0; i < sb->ninodes; i++)
+    {
+        dip = get_inode(i); // get inode
+        if (dip->type != 0 && valid_data_block(dip->addrs[NDIRECT]))
+            prefetch_block(dip->addrs[NDIRECT]);
+    }
+    flush_prefetch();
+}
+
+// collect consecutive blocks into one run so a contiguous directory costs one madvise call
+void prefetch_block(uint bnum)
+{
+    if (bnum == prefetch_end && prefetch_end > prefetch_first)
+    {
+        prefetch_end++;
+        return;
+    }
+    flush_prefetch();
+    prefetch_first = bnum;
+    prefetch_end = bnum + 1;
+}
+
+void flush_prefetch(void)
+{
+    if (prefetch_end > prefetch_first)
+        advise_blocks(prefetch_first, prefetch_end, MADV_WILLNEED);
+    prefetch_first = prefetch_end = 0;
+}
+
+void print_stats(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        fprintf(stderr, "page faults: %ld minor, %ld major\n", ru.ru_minflt, ru.ru_majflt);
+}
+
+// a whole decimal or 0x number no larger than max, with nothing after it and no sign
+bool parse_number(char *s, unsigned long long max, unsigned long long *value)
+{
+    char *end;
+    if (*s < '0' || *s > '9')
+        return false;
+    errno = 0;
+    *value = strtoull(s, &end, 0);
+    return errno == 0 && *end == '\0' && *value <= max;
 }
 
 void error(char *e)